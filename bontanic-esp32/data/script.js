@@ -56,7 +56,11 @@ function onMessage(event) {
 
     for (var i = 0; i < keys.length; i++){
         var key = keys[i];
-        document.getElementById(key).innerHTML = myObj[key];
+        var element = document.getElementById(key);
+        // Not every field has a card, e.g. the web layer stats
+        if (element) {
+            element.innerHTML = myObj[key];
+        }
     }
 }
 
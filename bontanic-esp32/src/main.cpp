@@ -11,6 +11,9 @@
 #include <ESPAsyncWebServer.h>
 #include <Arduino_JSON.h>
 #include <esp_system.h>
+#include <esp_timer.h>
+#include <sys/time.h>
+#include <memory>
 #define ENABLE_GxEPD2_GFX 0
 #include <GxEPD2_BW.h>
 #include <Fonts/FreeMonoBold9pt7b.h>
@@ -23,6 +26,7 @@
 void addDataPoint(float temp, float humid, float soil);
 void processAverages(float temperature, float humidity, float soil);
 void rotateFile();
+void flushPendingDataPoints();
 
 // Forward declaration of readHelloWorld
 void readHelloWorld();
@@ -59,6 +63,15 @@ const char* ntpServer = "pool.ntp.org";
 const long gmtOffset_sec = 3600;     // CET (UTC+1)
 const int daylightOffset_sec = 3600;  // CEST adds +1 hour during summer
 
+// System time before this means SNTP has not set the clock yet
+const time_t MIN_VALID_EPOCH = 1704067200;  // 2024-01-01
+const unsigned long CLOCK_RESYNC_INTERVAL = 60 * 60 * 1000;  // 1 hour
+
+// Offset from the monotonic esp_timer clock to epoch time, learned from NTP
+int64_t clockOffsetUs = 0;
+bool clockSynced = false;
+unsigned long lastClockSync = 0;
+
 // Constants for data storage
 const char* DATA_FILE = "/sensor_data.csv";
 const size_t MAX_FILE_SIZE = 1024 * 1024;  // 1MB
@@ -117,9 +130,9 @@ const unsigned char soil_icon[] PROGMEM = {
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 };
 
-// Add near other global variables
+// Data points taken before the clock is synced, kept until they can be back-dated
 struct DataPoint {
-    uint32_t timestamp;
+    uint32_t timestamp;  // Seconds since boot
     float temperature;
     float humidity;
     float soil;
@@ -130,7 +143,47 @@ DataPoint dataBuffer[BUFFER_SIZE];
 size_t bufferIndex = 0;
 size_t totalStoredPoints = 0;
 
+// Seconds since boot, unaffected by NTP adjustments
+uint32_t monotonicSeconds() {
+    return (uint32_t)(esp_timer_get_time() / 1000000);
+}
+
+time_t monotonicToEpoch(uint32_t seconds) {
+    return (time_t)((clockOffsetUs + (int64_t)seconds * 1000000) / 1000000);
+}
+
+time_t currentEpoch() {
+    return monotonicToEpoch(monotonicSeconds());
+}
+
+int64_t currentEpochMs() {
+    return (clockOffsetUs + esp_timer_get_time()) / 1000;
+}
 
+// Learn the epoch offset once SNTP has set the system time, then refresh it hourly
+void syncClock() {
+    if (clockSynced && (millis() - lastClockSync) < CLOCK_RESYNC_INTERVAL) return;
+
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    if (now.tv_sec < MIN_VALID_EPOCH) return;
+
+    clockOffsetUs = (int64_t)now.tv_sec * 1000000 + now.tv_usec - esp_timer_get_time();
+    lastClockSync = millis();
+
+    if (!clockSynced) {
+        clockSynced = true;
+        Serial.println("Clock synced");
+        flushPendingDataPoints();
+    }
+}
+
+// Local time is only applied when rendering, stored timestamps stay in epoch seconds
+void formatLocalTime(time_t epoch, char* buffer, size_t size, const char* format) {
+    struct tm timeinfo;
+    localtime_r(&epoch, &timeinfo);
+    strftime(buffer, size, format, &timeinfo);
+}
 
 // Add this to your setup function
 void setupStorage() {
@@ -164,10 +217,9 @@ void displayTimeBar() {
     display.fillRect(0, 0, display.width(), 20, GxEPD_BLACK);
     
     // Get current time
-    struct tm timeinfo;
-    if(getLocalTime(&timeinfo)) {
+    if(clockSynced) {
         char timeString[20];
-        strftime(timeString, sizeof(timeString), "%Y-%m-%d %H:%M", &timeinfo);
+        formatLocalTime(currentEpoch(), timeString, sizeof(timeString), "%Y-%m-%d %H:%M");
         
         // Display time in white
         display.setTextColor(GxEPD_WHITE);
@@ -337,7 +389,13 @@ void initLittleFS() {
     Serial.println("LittleFS mounted successfully");
 }
 
+// Broadcasts that found at least one client queue full, reported for load testing
+uint32_t wsQueueFullCount = 0;
+
 void notifyClients(String sensorReadings) {
+    if (!ws.availableForWriteAll()) {
+        wsQueueFullCount++;
+    }
     ws.textAll(sensorReadings);
 }
 
@@ -346,6 +404,7 @@ String getSensorReadings() {
     float temperature = dht.readTemperature();
     float humidity = dht.readHumidity();
     int soilMoisture = analogRead(SOIL_PIN);
+    int64_t sampleMs = clockSynced ? currentEpochMs() : 0;
     
     if (isnan(temperature) || isnan(humidity)) {
         Serial.println("Failed to read from DHT sensor!");
@@ -370,6 +429,14 @@ String getSensorReadings() {
     readings["flash"] = String(ESP.getFlashChipSize() / (1024 * 1024)); // Convert to MB
     readings["sketch"] = String(ESP.getSketchSize() / 1024);   // Convert to KB
     readings["freespace"] = String(ESP.getFreeSketchSpace() / 1024);  // Convert to KB
+
+    // Web layer stats, used by tools/ws_bench to measure latency under load
+    char sampleMsString[21];
+    snprintf(sampleMsString, sizeof(sampleMsString), "%lld", (long long)sampleMs);
+    readings["sampleMs"] = sampleMsString;                        // Epoch ms, 0 before clock sync
+    readings["heapMin"] = String(ESP.getMinFreeHeap() / 1024);   // Low-water mark in KB
+    readings["wsClients"] = String(ws.count());
+    readings["wsFull"] = String(wsQueueFullCount);
     
     processAverages(temperature, humidity, soilPercent);
 
@@ -451,6 +518,28 @@ void initWebSocket() {
     server.addHandler(&ws);
 }
 
+// State of one CSV download, shared with the chunk callback
+struct CsvExport {
+    File file;
+    String pending;
+};
+
+// Render the epoch timestamp of a stored CSV line as local time
+String renderCsvLine(String line) {
+    line.trim();
+    if (line.length() == 0) return "";
+
+    // Header and rows written before epoch timestamps pass through unchanged
+    int comma = line.indexOf(',');
+    char *end;
+    long epoch = strtol(line.c_str(), &end, 10);
+    if (comma <= 0 || end != line.c_str() + comma) return line + "\n";
+
+    char timestamp[20];
+    formatLocalTime((time_t)epoch, timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S");
+    return String(timestamp) + line.substring(comma) + "\n";
+}
+
 // Add this before the AsyncWebServer server(80); line
 void setupDataEndpoint(AsyncWebServer *server) {
     server->on("/downloadcsv", HTTP_GET, [](AsyncWebServerRequest *request) {
@@ -459,7 +548,31 @@ void setupDataEndpoint(AsyncWebServer *server) {
             return;
         }
 
-        AsyncWebServerResponse *response = request->beginResponse(LittleFS, DATA_FILE, "text/csv");
+        std::shared_ptr<CsvExport> csv = std::make_shared<CsvExport>();
+        csv->file = LittleFS.open(DATA_FILE, "r");
+        if (!csv->file) {
+            request->send(500, "text/plain", "Failed to open data file");
+            return;
+        }
+
+        AsyncWebServerResponse *response = request->beginChunkedResponse("text/csv",
+            [csv](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                size_t written = 0;
+                while (written < maxLen) {
+                    if (csv->pending.length() == 0) {
+                        if (!csv->file.available()) break;
+                        csv->pending = renderCsvLine(csv->file.readStringUntil('\n'));
+                        continue;
+                    }
+
+                    size_t len = csv->pending.length();
+                    if (len > maxLen - written) len = maxLen - written;
+                    memcpy(buffer + written, csv->pending.c_str(), len);
+                    csv->pending.remove(0, len);
+                    written += len;
+                }
+                return written;
+            });
         response->addHeader("Content-Disposition", "attachment; filename=sensor_data.csv");
         response->addHeader("Access-Control-Allow-Origin", "*");
         request->send(response);
@@ -522,11 +635,11 @@ void setup() {
         Serial.println("OTA Ready");
         Serial.print("IP address: ");
         Serial.println(WiFi.localIP());
-
-        // Initialize and get the time
-        configTime(gmtOffset_sec, daylightOffset_sec, ntpServer);
     }
 
+    // Initialize and get the time, also sets the timezone used for rendering
+    configTime(gmtOffset_sec, daylightOffset_sec, ntpServer);
+
     initLittleFS();
     initWebSocket();
 
@@ -547,6 +660,7 @@ void setup() {
 
 void loop() {
     ArduinoOTA.handle();  // This must stay!
+    syncClock();
 
     if ((millis() - lastTime) > timerDelay) {
         String readings = getSensorReadings();
@@ -591,39 +705,74 @@ void readHelloWorld() {
   file.close();
 }
 
+// Open the data file for appending, rotating it first if it grew too large
+File openDataFile() {
+    File file = LittleFS.open(DATA_FILE, "a");
+
+    // Check file size before writing
+    if (file && file.size() >= MAX_FILE_SIZE) {
+        file.close();
+        rotateFile();
+        file = LittleFS.open(DATA_FILE, "a");
+    }
+    return file;
+}
+
 void addDataPoint(float temp, float humid, float soil) {
     if (isnan(temp) || isnan(humid)) {
         Serial.println("Invalid sensor readings");
         return;
     }
 
-    File file = LittleFS.open(DATA_FILE, "a");
+    // Without a synced clock keep the point in memory, the oldest is overwritten when full
+    if (!clockSynced) {
+        DataPoint &point = dataBuffer[bufferIndex];
+        point.timestamp = monotonicSeconds();
+        point.temperature = temp;
+        point.humidity = humid;
+        point.soil = soil;
+        bufferIndex = (bufferIndex + 1) % BUFFER_SIZE;
+        if (totalStoredPoints < BUFFER_SIZE) {
+            totalStoredPoints++;
+        }
+        return;
+    }
+
+    // Keep the file in order if an earlier flush failed
+    flushPendingDataPoints();
+
+    File file = openDataFile();
     if (!file) {
         Serial.println("Failed to open file for writing");
         return;
     }
 
-    // Get current time
-    struct tm timeinfo;
-    if (!getLocalTime(&timeinfo)) {
-        Serial.println("Failed to obtain time");
-        file.close();
+    // Write data in CSV format
+    file.printf("%ld,%.2f,%.2f,%.2f\n", (long)currentEpoch(), temp, humid, soil);
+    file.close();
+}
+
+// Write the buffered data points back-dated with the learned clock offset
+void flushPendingDataPoints() {
+    if (totalStoredPoints == 0) return;
+
+    File file = openDataFile();
+    if (!file) {
+        Serial.println("Failed to open file for writing");
         return;
     }
 
-    // Check file size before writing
-    if (file.size() >= MAX_FILE_SIZE) {
-        file.close();
-        rotateFile();
-        file = LittleFS.open(DATA_FILE, "a");
+    size_t start = (bufferIndex + BUFFER_SIZE - totalStoredPoints) % BUFFER_SIZE;
+    for (size_t i = 0; i < totalStoredPoints; i++) {
+        const DataPoint &point = dataBuffer[(start + i) % BUFFER_SIZE];
+        file.printf("%ld,%.2f,%.2f,%.2f\n", (long)monotonicToEpoch(point.timestamp),
+                    point.temperature, point.humidity, point.soil);
     }
-
-    char timestamp[20];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M", &timeinfo);
-    
-    // Write data in CSV format
-    file.printf("%s,%.2f,%.2f,%.2f\n", timestamp, temp, humid, soil);
     file.close();
+
+    Serial.printf("Wrote %u buffered data points\n", (unsigned)totalStoredPoints);
+    bufferIndex = 0;
+    totalStoredPoints = 0;
 }
 
 void rotateFile() {
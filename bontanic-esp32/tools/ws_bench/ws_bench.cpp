@@ -0,0 +1,487 @@
+/*********
+  ws_bench - WebSocket fan-out load generator for the bontanic web layer
+
+  Opens a swarm of WebSocket clients against /ws and reports sample-to-client
+  latency, frames per second and the server heap/queue stats that are sent
+  along with every reading.
+
+  Usage: ws_bench --host <ip> [--port 80] [--path /ws] [--clients 8]
+                  [--mode idle|poll] [--poll-ms 2000] [--slow 0]
+                  [--slow-rcvbuf 1024] [--duration 60]
+
+  Poll clients behave like data/script.js and send "getReadings" every
+  --poll-ms. Idle clients only listen. Slow readers complete the handshake
+  and then never read from their socket.
+
+  Latency uses the "sampleMs" field, so it is only measured once the device
+  clock is synced, and includes the NTP offset between device and host.
+*********/
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+const int MAX_CLIENTS = 64;
+const size_t MAX_FRAME_SIZE = 64 * 1024;
+
+enum class ClientKind { Idle, Poll, Slow };
+enum class ClientState { Handshake, Open, Closed };
+
+struct Client {
+    int fd = -1;
+    ClientKind kind = ClientKind::Idle;
+    ClientState state = ClientState::Handshake;
+    std::string rx;
+    Clock::time_point nextPoll;
+    Clock::time_point pollSentAt;
+    bool pollPending = false;
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    bool closedByServer = false;
+    double closedAfter = 0;   // Seconds into the run when the server closed us
+};
+
+struct Options {
+    std::string host;
+    int port = 80;
+    std::string path = "/ws";
+    int clients = 8;
+    ClientKind mode = ClientKind::Idle;
+    int pollMs = 2000;
+    int slow = 0;
+    int slowRcvbuf = 1024;
+    int duration = 60;
+};
+
+// Server stats, taken from the readings JSON
+struct ServerStats {
+    double heapMinKb = -1;
+    double heapLowKb = -1;
+    double clientsMax = 0;
+    double queueFull = 0;
+};
+
+std::mt19937 rng(std::random_device{}());
+
+double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+int64_t wallClockMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void usage() {
+    fprintf(stderr,
+        "Usage: ws_bench --host <ip> [--port 80] [--path /ws] [--clients 8]\n"
+        "                [--mode idle|poll] [--poll-ms 2000] [--slow 0]\n"
+        "                [--slow-rcvbuf 1024] [--duration 60]\n");
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage();
+            return false;
+        }
+        std::string value = argv[++i];
+
+        if (arg == "--host") options.host = value;
+        else if (arg == "--port") options.port = atoi(value.c_str());
+        else if (arg == "--path") options.path = value;
+        else if (arg == "--clients") options.clients = atoi(value.c_str());
+        else if (arg == "--poll-ms") options.pollMs = atoi(value.c_str());
+        else if (arg == "--slow") options.slow = atoi(value.c_str());
+        else if (arg == "--slow-rcvbuf") options.slowRcvbuf = atoi(value.c_str());
+        else if (arg == "--duration") options.duration = atoi(value.c_str());
+        else if (arg == "--mode") {
+            if (value == "idle") options.mode = ClientKind::Idle;
+            else if (value == "poll") options.mode = ClientKind::Poll;
+            else {
+                usage();
+                return false;
+            }
+        } else {
+            usage();
+            return false;
+        }
+    }
+
+    if (options.host.empty() || options.clients < 1 || options.clients > MAX_CLIENTS ||
+        options.slow < 0 || options.clients + options.slow > MAX_CLIENTS ||
+        options.pollMs <= 0 || options.duration <= 0) {
+        fprintf(stderr, "Need --host, 1-%d clients in total and positive intervals\n", MAX_CLIENTS);
+        return false;
+    }
+    return true;
+}
+
+int connectTo(const Options& options, int rcvbuf) {
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo* result = nullptr;
+    std::string port = std::to_string(options.port);
+    if (getaddrinfo(options.host.c_str(), port.c_str(), &hints, &result) != 0) {
+        return -1;
+    }
+
+    int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (fd >= 0) {
+        // The receive buffer has to be set before connect to limit the TCP window
+        if (rcvbuf > 0) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if (connect(fd, result->ai_addr, result->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+bool sendAll(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Client frames have to be masked (RFC 6455 5.3)
+bool sendFrame(Client& client, uint8_t opcode, const std::string& payload) {
+    std::string frame;
+    frame.push_back((char)(0x80 | opcode));
+    if (payload.size() < 126) {
+        frame.push_back((char)(0x80 | payload.size()));
+    } else {
+        frame.push_back((char)(0x80 | 126));
+        frame.push_back((char)(payload.size() >> 8));
+        frame.push_back((char)(payload.size() & 0xFF));
+    }
+
+    uint8_t mask[4];
+    for (uint8_t& byte : mask) byte = (uint8_t)rng();
+    frame.append((const char*)mask, 4);
+    for (size_t i = 0; i < payload.size(); i++) {
+        frame.push_back((char)(payload[i] ^ mask[i % 4]));
+    }
+    return sendAll(client.fd, frame);
+}
+
+bool jsonNumber(const std::string& json, const char* key, double& value) {
+    std::string needle = std::string("\"") + key + "\":";
+    size_t pos = json.find(needle);
+    if (pos == std::string::npos) return false;
+
+    pos += needle.size();
+    // Arduino_JSON sends most readings as strings
+    if (pos < json.size() && json[pos] == '"') pos++;
+
+    const char* start = json.c_str() + pos;
+    char* end;
+    value = strtod(start, &end);
+    return end != start;
+}
+
+double percentile(std::vector<double>& samples, double p) {
+    if (samples.empty()) return 0;
+    std::sort(samples.begin(), samples.end());
+    size_t rank = (size_t)(p / 100.0 * (samples.size() - 1) + 0.5);
+    return samples[rank];
+}
+
+void printPercentiles(const char* name, std::vector<double>& samples) {
+    if (samples.empty()) {
+        printf("%-18s n/a\n", name);
+        return;
+    }
+    printf("%-18s n=%zu p50=%.1f p90=%.1f p99=%.1f max=%.1f ms\n", name, samples.size(),
+           percentile(samples, 50), percentile(samples, 90), percentile(samples, 99),
+           percentile(samples, 100));
+}
+
+struct Results {
+    std::vector<double> latencyMs;
+    std::vector<double> pollRttMs;
+    ServerStats server;
+};
+
+void handleText(Client& client, const std::string& payload, Results& results) {
+    client.frames++;
+    client.bytes += payload.size();
+
+    if (client.pollPending) {
+        results.pollRttMs.push_back(
+            std::chrono::duration<double, std::milli>(Clock::now() - client.pollSentAt).count());
+        client.pollPending = false;
+    }
+
+    double value;
+    if (jsonNumber(payload, "sampleMs", value) && value > 0) {
+        results.latencyMs.push_back((double)wallClockMs() - value);
+    }
+
+    ServerStats& server = results.server;
+    if (jsonNumber(payload, "heap", value) && (server.heapLowKb < 0 || value < server.heapLowKb)) {
+        server.heapLowKb = value;
+    }
+    if (jsonNumber(payload, "heapMin", value) && (server.heapMinKb < 0 || value < server.heapMinKb)) {
+        server.heapMinKb = value;
+    }
+    if (jsonNumber(payload, "wsClients", value)) {
+        server.clientsMax = std::max(server.clientsMax, value);
+    }
+    if (jsonNumber(payload, "wsFull", value)) {
+        server.queueFull = std::max(server.queueFull, value);
+    }
+}
+
+// Returns false once the connection is gone
+bool readFrames(Client& client, Results& results) {
+    char buffer[4096];
+    ssize_t n = recv(client.fd, buffer, sizeof(buffer), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return true;
+    if (n <= 0) return false;
+    client.rx.append(buffer, n);
+
+    if (client.state == ClientState::Handshake) {
+        size_t end = client.rx.find("\r\n\r\n");
+        if (end == std::string::npos) return true;
+        if (client.rx.compare(0, 12, "HTTP/1.1 101") != 0) {
+            fprintf(stderr, "Handshake rejected: %s\n", client.rx.substr(0, client.rx.find('\r')).c_str());
+            return false;
+        }
+        client.rx.erase(0, end + 4);
+        client.state = ClientState::Open;
+    }
+
+    // Server frames are unmasked, fragmented messages are not used by AsyncWebSocket
+    while (client.rx.size() >= 2) {
+        const uint8_t* data = (const uint8_t*)client.rx.data();
+        uint8_t opcode = data[0] & 0x0F;
+        size_t header = 2;
+        uint64_t length = data[1] & 0x7F;
+        if (length == 126) {
+            if (client.rx.size() < 4) break;
+            length = ((uint64_t)data[2] << 8) | data[3];
+            header = 4;
+        } else if (length == 127) {
+            if (client.rx.size() < 10) break;
+            length = 0;
+            for (int i = 0; i < 8; i++) length = (length << 8) | data[2 + i];
+            header = 10;
+        }
+        if (length > MAX_FRAME_SIZE) {
+            fprintf(stderr, "Frame too large: %llu bytes\n", (unsigned long long)length);
+            return false;
+        }
+        if (client.rx.size() < header + length) break;
+
+        std::string payload = client.rx.substr(header, length);
+        client.rx.erase(0, header + length);
+
+        if (opcode == 0x1) {
+            handleText(client, payload, results);
+        } else if (opcode == 0x8) {
+            client.closedByServer = true;
+            return false;
+        } else if (opcode == 0x9) {
+            sendFrame(client, 0xA, payload);
+        }
+    }
+    return true;
+}
+
+void closeClient(Client& client) {
+    close(client.fd);
+    client.fd = -1;
+    client.state = ClientState::Closed;
+}
+
+const char* kindName(ClientKind kind) {
+    switch (kind) {
+        case ClientKind::Idle: return "idle";
+        case ClientKind::Poll: return "poll";
+        case ClientKind::Slow: return "slow";
+    }
+    return "?";
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) return 1;
+
+    std::string handshake =
+        "GET " + options.path + " HTTP/1.1\r\n"
+        "Host: " + options.host + "\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n\r\n";
+
+    Results results;
+    std::vector<Client> clients(options.clients + options.slow);
+    int failed = 0;
+    for (size_t i = 0; i < clients.size(); i++) {
+        Client& client = clients[i];
+        client.kind = (int)i < options.clients ? options.mode : ClientKind::Slow;
+        client.fd = connectTo(options, client.kind == ClientKind::Slow ? options.slowRcvbuf : 0);
+        if (client.fd < 0 || !sendAll(client.fd, handshake)) {
+            if (client.fd >= 0) close(client.fd);
+            client.fd = -1;
+            client.state = ClientState::Closed;
+            failed++;
+            continue;
+        }
+        // Spread the polls like independent browser tabs would
+        client.nextPoll = Clock::now() + std::chrono::milliseconds(rng() % options.pollMs);
+    }
+    if (failed > 0) {
+        fprintf(stderr, "%d of %zu clients failed to connect\n", failed, clients.size());
+    }
+
+    Clock::time_point measureStart = Clock::now();
+    Clock::time_point deadline = measureStart + std::chrono::seconds(options.duration);
+    std::vector<pollfd> fds;
+    std::vector<Client*> polled;
+
+    while (Clock::now() < deadline) {
+        fds.clear();
+        polled.clear();
+        Clock::time_point wake = std::min(deadline, Clock::now() + std::chrono::milliseconds(100));
+
+        for (Client& client : clients) {
+            if (client.state == ClientState::Closed) continue;
+
+            pollfd entry = { client.fd, POLLIN, 0 };
+            // Slow readers stop reading after the handshake, only watch for the server closing them
+            if (client.kind == ClientKind::Slow && client.state == ClientState::Open) {
+                entry.events = POLLRDHUP;
+            }
+            fds.push_back(entry);
+            polled.push_back(&client);
+
+            if (client.kind == ClientKind::Poll && client.state == ClientState::Open) {
+                wake = std::min(wake, client.nextPoll);
+            }
+        }
+
+        int timeout = (int)std::chrono::duration_cast<std::chrono::milliseconds>(wake - Clock::now()).count();
+        if (poll(fds.data(), fds.size(), std::max(timeout, 0)) < 0 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+
+        for (size_t i = 0; i < fds.size(); i++) {
+            Client& client = *polled[i];
+            if (fds[i].revents == 0) continue;
+
+            bool slowReader = client.kind == ClientKind::Slow && client.state == ClientState::Open;
+            if (slowReader || !readFrames(client, results)) {
+                if (client.state == ClientState::Open) {
+                    client.closedByServer = true;
+                    client.closedAfter = secondsSince(measureStart);
+                }
+                closeClient(client);
+            }
+        }
+
+        Clock::time_point now = Clock::now();
+        for (Client& client : clients) {
+            if (client.kind != ClientKind::Poll || client.state != ClientState::Open) continue;
+            if (now < client.nextPoll) continue;
+
+            if (!sendFrame(client, 0x1, "getReadings")) {
+                closeClient(client);
+                continue;
+            }
+            if (!client.pollPending) {
+                client.pollSentAt = now;
+                client.pollPending = true;
+            }
+            client.nextPoll = now + std::chrono::milliseconds(options.pollMs);
+        }
+    }
+
+    double elapsed = secondsSince(measureStart);
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    int open = 0;
+    int closedByServer = 0;
+    int slowClosed = 0;
+    double slowClosedFirst = -1;
+
+    for (Client& client : clients) {
+        frames += client.frames;
+        bytes += client.bytes;
+        if (client.state == ClientState::Open) open++;
+        if (client.closedByServer) {
+            closedByServer++;
+            if (client.kind == ClientKind::Slow) {
+                slowClosed++;
+                if (slowClosedFirst < 0 || client.closedAfter < slowClosedFirst) {
+                    slowClosedFirst = client.closedAfter;
+                }
+            }
+        }
+    }
+
+    printf("clients            %d %s + %d slow, %d failed to connect\n",
+           options.clients, kindName(options.mode), options.slow, failed);
+    printf("duration           %.1f s\n", elapsed);
+    printf("still open         %d, closed by server %d\n", open, closedByServer);
+    if (options.slow > 0) {
+        if (slowClosed > 0) {
+            printf("slow readers       %d closed by server, first after %.1f s\n", slowClosed, slowClosedFirst);
+        } else {
+            printf("slow readers       none closed by server\n");
+        }
+    }
+    printf("frames             %llu total, %.1f/s, %.2f/s per reading client\n",
+           (unsigned long long)frames, frames / elapsed,
+           options.clients > 0 ? frames / elapsed / options.clients : 0.0);
+    printf("throughput         %.1f KB/s\n", bytes / elapsed / 1024);
+    printPercentiles("sample latency", results.latencyMs);
+    printPercentiles("poll to frame", results.pollRttMs);
+
+    const ServerStats& server = results.server;
+    if (server.heapLowKb >= 0) {
+        printf("server heap        low %.0f KB, min free since boot %.0f KB\n", server.heapLowKb, server.heapMinKb);
+        printf("server ws clients  max %.0f\n", server.clientsMax);
+        printf("server queue full  %.0f broadcasts since boot\n", server.queueFull);
+    } else {
+        printf("server stats       n/a (no readings received)\n");
+    }
+
+    for (Client& client : clients) {
+        if (client.fd >= 0) close(client.fd);
+    }
+    return 0;
+}